@@ -9,6 +9,8 @@
 #include <tuple>
 #include <regex>
 #include <filesystem>
+#include <utility>
+#include <algorithm>
 
 using sample_type = unsigned char;
 using width_type = size_t;
@@ -31,16 +33,112 @@ void write_png_to_file(sample_type* image, width_type width, height_type height,
   png_destroy_write_struct(&png, &info);
 }
 
-void write_diff_png_to_file(sample_type* from, sample_type* to, width_type width, height_type height, FILE* fp, size_t* offset_x, size_t* offset_y) {
+// Encodes an RGBA image in the QOI format (https://qoiformat.org/). It is
+// larger than PNG but decodes several times faster, so it suits archives that
+// are loaded at runtime.
+void qoi_encode(const sample_type* image, width_type width, height_type height, std::vector<sample_type>& out) {
+  const auto put32 = [&out](uint32_t v) {
+    out.push_back(static_cast<sample_type>(v >> 24));
+    out.push_back(static_cast<sample_type>(v >> 16));
+    out.push_back(static_cast<sample_type>(v >> 8));
+    out.push_back(static_cast<sample_type>(v));
+  };
+  out.clear();
+  out.reserve(14 + width * height + 8);
+  out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+  put32(static_cast<uint32_t>(width));
+  put32(static_cast<uint32_t>(height));
+  out.push_back(4);  // channels
+  out.push_back(0);  // sRGB with linear alpha
+  sample_type index[64][4] = {};
+  sample_type prev[4] = { 0, 0, 0, 0xff };
+  size_t run = 0;
+  const size_t num_pixels = width * height;
+  for (size_t i = 0; i < num_pixels; i++) {
+    const sample_type* px = image + i * 4;
+    if (memcmp(px, prev, 4) == 0) {
+      ++run;
+      if (run == 62 || i == num_pixels - 1) {
+        out.push_back(static_cast<sample_type>(0xc0 | (run - 1)));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      out.push_back(static_cast<sample_type>(0xc0 | (run - 1)));
+      run = 0;
+    }
+    const size_t hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+    if (memcmp(index[hash], px, 4) == 0) {
+      out.push_back(static_cast<sample_type>(hash));
+    } else {
+      memcpy_s(index[hash], 4, px, 4);
+      if (px[3] == prev[3]) {
+        const int vr = static_cast<signed char>(px[0] - prev[0]);
+        const int vg = static_cast<signed char>(px[1] - prev[1]);
+        const int vb = static_cast<signed char>(px[2] - prev[2]);
+        const int vg_r = vr - vg;
+        const int vg_b = vb - vg;
+        if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+          out.push_back(static_cast<sample_type>(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2)));
+        } else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 && vg_b >= -8 && vg_b <= 7) {
+          out.push_back(static_cast<sample_type>(0x80 | (vg + 32)));
+          out.push_back(static_cast<sample_type>((vg_r + 8) << 4 | (vg_b + 8)));
+        } else {
+          out.insert(out.end(), { 0xfe, px[0], px[1], px[2] });
+        }
+      } else {
+        out.insert(out.end(), { 0xff, px[0], px[1], px[2], px[3] });
+      }
+    }
+    memcpy_s(prev, 4, px, 4);
+  }
+  out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+}
+
+enum class codec_type { png, qoi };
+
+void write_blob_to_file(codec_type codec, sample_type* image, width_type width, height_type height, FILE* fp) {
+  if (codec == codec_type::qoi) {
+    std::vector<sample_type> blob;
+    qoi_encode(image, width, height, blob);
+    fwrite(blob.data(), 1, blob.size(), fp);
+    return;
+  }
+  write_png_to_file(image, width, height, fp);
+}
+
+// Returns row y of "image" shifted by (shift_x, shift_y). Pixels that the
+// shifted image does not cover are transparent.
+const uint32_t* shifted_row(const sample_type* image, width_type width, height_type height, size_t y, ptrdiff_t shift_x, ptrdiff_t shift_y, std::vector<uint32_t>& buffer) {
+  const uint32_t* source = reinterpret_cast<const uint32_t*>(image);
+  if (shift_x == 0 && shift_y == 0) {
+    return source + y * width;
+  }
+  buffer.assign(width, 0);
+  const ptrdiff_t sy = static_cast<ptrdiff_t>(y) - shift_y;
+  if (sy < 0 || sy >= static_cast<ptrdiff_t>(height)) {
+    return buffer.data();
+  }
+  const ptrdiff_t x0 = std::max<ptrdiff_t>(0, shift_x);
+  const ptrdiff_t x1 = std::min<ptrdiff_t>(width, width + shift_x);
+  if (x0 < x1) {
+    memcpy_s(buffer.data() + x0, (width - x0) * 4, source + sy * width + x0 - shift_x, (x1 - x0) * 4);
+  }
+  return buffer.data();
+}
+
+void write_diff_to_file(codec_type codec, sample_type* from, sample_type* to, width_type width, height_type height, ptrdiff_t shift_x, ptrdiff_t shift_y, FILE* fp, size_t* offset_x, size_t* offset_y) {
   std::vector<sample_type> diff(width * height * 4);
+  std::vector<uint32_t> parent_row;
   size_t left = std::numeric_limits<size_t>::max();
   size_t top = std::numeric_limits<size_t>::max();
   size_t right = std::numeric_limits<size_t>::max();
   size_t bottom = std::numeric_limits<size_t>::max();
-  uint32_t* f = reinterpret_cast<uint32_t*>(from);
   uint32_t* t = reinterpret_cast<uint32_t*>(to);
   uint32_t* d = reinterpret_cast<uint32_t*>(diff.data());
   for (size_t y = 0; y < height; y++) {
+    const uint32_t* f = shifted_row(from, width, height, y, shift_x, shift_y, parent_row);
     for (size_t x = 0; x < width; x++) {
       if (*f != *t) {
         *d = *t;
@@ -65,7 +163,7 @@ void write_diff_png_to_file(sample_type* from, sample_type* to, width_type width
   for (size_t y = 0; y < ch; y++) {
     memcpy_s(cropped.data() + y * cw * 4, cw * 4, diff.data() + (top + y) * width * 4 + left * 4, cw * 4);
   }
-  write_png_to_file(cropped.data(), cw, ch, fp);
+  write_blob_to_file(codec, cropped.data(), cw, ch, fp);
   *offset_x = left;
   *offset_y = top;
   return;
@@ -107,7 +205,59 @@ image_type read_png_from_file(const char* filename) {
 }
 
 void print_usage() {
-  std::cout << "usage: organize -s solution.txt [-o output_dir] matrix.txt" << std::endl;
+  std::cout << "usage: organize -s solution.txt [-o output_dir] [-c png|qoi] matrix.txt" << std::endl;
+}
+
+// Reads the sections that scan appends after the matrix.
+// shifts[i][j] is the shift of image i when image j is stored as a diff from it
+// (scan --shift-radius). aliases lists the images identical to image
+// aliases[k].first, which scan left out of the matrix.
+void load_sections(std::ifstream& graph, size_t N, std::vector<std::vector<std::pair<ptrdiff_t, ptrdiff_t> > >& shifts, std::vector<std::pair<size_t, std::string> >& aliases) {
+  shifts.assign(N, std::vector<std::pair<ptrdiff_t, ptrdiff_t> >(N));
+  aliases.clear();
+  size_t cost;
+  for (size_t i = 0; i < N * N; ++i) {
+    graph >> cost;
+  }
+  std::string tag;
+  while (graph >> tag) {
+    if (tag == "shift") {
+      char comma;
+      for (auto& row : shifts) {
+        for (auto& cell : row) {
+          graph >> cell.first >> comma >> cell.second;
+        }
+      }
+    } else if (tag == "alias") {
+      size_t count;
+      graph >> count;
+      aliases.resize(count);
+      for (auto& alias : aliases) {
+        graph >> alias.first >> alias.second;
+      }
+    }
+  }
+}
+
+std::string get_basename(const std::string& filename) {
+  const auto delim = filename.find_last_of("/\\");
+  const auto offset = (delim == std::string::npos) ? 0 : delim + 1;
+  const auto ext = filename.find_last_of(".");
+  const auto count = (ext == std::string::npos || ext < offset) ? std::string::npos : ext - offset;
+  return filename.substr(offset, count);
+}
+
+// Writes the metadata of an image that is identical to another one. It has no
+// blob of its own, so reconstruct takes the referenced image as is.
+bool write_alias_metadata(const std::string& filename_stir, const std::string& basename_origin) {
+  std::ofstream metadata(filename_stir);
+  if (!metadata) {
+    std::cerr << "failed to write \"" << filename_stir << "\"" << std::endl;
+    return false;
+  }
+  metadata << std::endl;
+  metadata << basename_origin << ".stir" << std::endl;
+  return true;
 }
 
 std::vector<size_t> load_solution(std::ifstream& solution, size_t N) {
@@ -134,6 +284,7 @@ int main(int argc, char** argv) {
   std::string solution_filename;
   std::string graph_filename;
   std::string output_dirname("output");
+  codec_type codec = codec_type::png;
   if (argc < 4) {
     print_usage();
     return 0;
@@ -148,6 +299,17 @@ int main(int argc, char** argv) {
       }
       solution_filename = argv[i];
       ++i;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      ++i;
+      if (i < argc && strcmp(argv[i], "png") == 0) {
+        codec = codec_type::png;
+      } else if (i < argc && strcmp(argv[i], "qoi") == 0) {
+        codec = codec_type::qoi;
+      } else {
+        print_usage();
+        return 0;
+      }
+      ++i;
     } else if (strcmp(argv[i], "-o") == 0) {
       ++i;
       if (i >= argc) {
@@ -177,11 +339,7 @@ int main(int argc, char** argv) {
   std::vector<image_type> images(N);
   for (size_t i = 0; i < N; ++i) {
     graph >> files[i];
-    const auto delim = files[i].find_last_of("/\\");
-    const auto offset = (delim == std::string::npos) ? 0 : delim + 1;
-    const auto ext = files[i].find_last_of(".");
-    const auto count = (ext == std::string::npos || ext < offset) ? std::string::npos : ext - offset;
-    basenames[i] = files[i].substr(offset, count);
+    basenames[i] = get_basename(files[i]);
     images[i] = read_png_from_file(files[i].c_str());
     if (std::get<0>(images[i]).empty()) {
       std::cerr << "failed to read \"" << files[i] << "\"" << std::endl;
@@ -192,6 +350,15 @@ int main(int argc, char** argv) {
       return -1;
     }
   }
+  std::vector<std::vector<std::pair<ptrdiff_t, ptrdiff_t> > > shifts;
+  std::vector<std::pair<size_t, std::string> > aliases;
+  load_sections(graph, N, shifts, aliases);
+  for (const auto& alias : aliases) {
+    if (alias.first >= N) {
+      std::cerr << "invalid alias of \"" << alias.second << "\"" << std::endl;
+      return -1;
+    }
+  }
   std::filesystem::create_directory(output_dirname);
   std::ifstream solution(solution_filename);
   if (!solution) {
@@ -199,45 +366,61 @@ int main(int argc, char** argv) {
     return -1;
   }
   auto arcs = load_solution(solution, N);
+  const std::string blob_ext = (codec == codec_type::qoi) ? ".qoi" : ".png";
   for (size_t i = 0; i < N; ++i) {
     if (arcs[i] == i) {
-      const auto filename_png = output_dirname + "/" + basenames[i] + ".png";
+      const auto filename_blob = output_dirname + "/" + basenames[i] + blob_ext;
       const auto filename_stir = output_dirname + "/" + basenames[i] + ".stir";
       FILE* fp;
-      if (fopen_s(&fp, filename_png.c_str(), "wb") || !fp) {
-        std::cerr << "failed to write \"" << filename_png << "\"" << std::endl;
+      if (fopen_s(&fp, filename_blob.c_str(), "wb") || !fp) {
+        std::cerr << "failed to write \"" << filename_blob << "\"" << std::endl;
         return -1;
       }
-      write_png_to_file(std::get<0>(images[i]).data(), std::get<1>(images[i]), std::get<2>(images[i]), fp);
+      write_blob_to_file(codec, std::get<0>(images[i]).data(), std::get<1>(images[i]), std::get<2>(images[i]), fp);
       fclose(fp);
       std::ofstream metadata(filename_stir);
       if (!metadata) {
         std::cerr << "failed to write \"" << filename_stir << "\"" << std::endl;
         return -1;
       }
-      metadata << basenames[i] << ".png" << std::endl;
+      metadata << basenames[i] << blob_ext << std::endl;
+    } else if (shifts[arcs[i]][i].first == 0 && shifts[arcs[i]][i].second == 0 && std::get<0>(images[arcs[i]]) == std::get<0>(images[i])) {
+      if (!write_alias_metadata(output_dirname + "/" + basenames[i] + ".stir", basenames[arcs[i]])) {
+        return -1;
+      }
     } else {
-      const auto filename_png = output_dirname + "/" + basenames[i] + ".png";
+      const auto filename_blob = output_dirname + "/" + basenames[i] + blob_ext;
       const auto filename_stir = output_dirname + "/" + basenames[i] + ".stir";
       FILE* fp;
-      if (fopen_s(&fp, filename_png.c_str(), "wb") || !fp) {
-        std::cerr << "failed to write \"" << filename_png << "\"" << std::endl;
+      if (fopen_s(&fp, filename_blob.c_str(), "wb") || !fp) {
+        std::cerr << "failed to write \"" << filename_blob << "\"" << std::endl;
         return -1;
       }
       size_t offset_x, offset_y;
-      write_diff_png_to_file(std::get<0>(images[arcs[i]]).data(),
-                             std::get<0>(images[i]).data(),
-                             std::get<1>(images[i]), std::get<2>(images[i]),
-                             fp, &offset_x, &offset_y);
+      const auto [shift_x, shift_y] = shifts[arcs[i]][i];
+      write_diff_to_file(codec,
+                         std::get<0>(images[arcs[i]]).data(),
+                         std::get<0>(images[i]).data(),
+                         std::get<1>(images[i]), std::get<2>(images[i]),
+                         shift_x, shift_y,
+                         fp, &offset_x, &offset_y);
       fclose(fp);
       std::ofstream metadata(filename_stir);
       if (!metadata) {
         std::cerr << "failed to write \"" << filename_stir << "\"" << std::endl;
         return -1;
       }
-      metadata << basenames[i] << ".png" << std::endl;
+      metadata << basenames[i] << blob_ext << std::endl;
       metadata << basenames[arcs[i]] << ".stir" << std::endl;
       metadata << offset_x << std::endl << offset_y << std::endl;
+      if (shift_x != 0 || shift_y != 0) {
+        metadata << shift_x << std::endl << shift_y << std::endl;
+      }
+    }
+  }
+  for (const auto& alias : aliases) {
+    if (!write_alias_metadata(output_dirname + "/" + get_basename(alias.second) + ".stir", basenames[alias.first])) {
+      return -1;
     }
   }
 }
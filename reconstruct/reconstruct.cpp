@@ -9,6 +9,7 @@
 #include <tuple>
 #include <regex>
 #include <filesystem>
+#include <algorithm>
 
 using sample_type = unsigned char;
 using width_type = size_t;
@@ -76,26 +77,133 @@ image_type read_png_from_file(const char* filename) {
   return { image, width, height };
 }
 
+// Decodes a QOI image (https://qoiformat.org/) into RGBA.
+image_type qoi_decode(const std::vector<sample_type>& blob) {
+  const auto get32 = [&blob](size_t p) {
+    return static_cast<uint32_t>(blob[p]) << 24 | static_cast<uint32_t>(blob[p + 1]) << 16 | static_cast<uint32_t>(blob[p + 2]) << 8 | static_cast<uint32_t>(blob[p + 3]);
+  };
+  if (blob.size() < 14 + 8) {
+    return { std::vector<sample_type>(), 0, 0 };
+  }
+  const width_type width = get32(4);
+  const height_type height = get32(8);
+  std::vector<sample_type> image(width * height * 4);
+  sample_type index[64][4] = {};
+  sample_type px[4] = { 0, 0, 0, 0xff };
+  size_t p = 14;
+  const size_t end = blob.size() - 8;
+  size_t run = 0;
+  for (auto out = image.begin(); out != image.end(); out += 4) {
+    if (run > 0) {
+      --run;
+    } else if (p < end) {
+      const sample_type op = blob[p++];
+      if (op == 0xfe) {
+        px[0] = blob[p];
+        px[1] = blob[p + 1];
+        px[2] = blob[p + 2];
+        p += 3;
+      } else if (op == 0xff) {
+        px[0] = blob[p];
+        px[1] = blob[p + 1];
+        px[2] = blob[p + 2];
+        px[3] = blob[p + 3];
+        p += 4;
+      } else if ((op & 0xc0) == 0x00) {
+        memcpy_s(px, 4, index[op], 4);
+      } else if ((op & 0xc0) == 0x40) {
+        px[0] += ((op >> 4) & 0x03) - 2;
+        px[1] += ((op >> 2) & 0x03) - 2;
+        px[2] += (op & 0x03) - 2;
+      } else if ((op & 0xc0) == 0x80) {
+        const int vg = (op & 0x3f) - 32;
+        const sample_type b2 = blob[p++];
+        px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+        px[1] += vg;
+        px[2] += vg - 8 + (b2 & 0x0f);
+      } else {
+        run = op & 0x3f;
+      }
+      memcpy_s(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], 4, px, 4);
+    }
+    std::copy(px, px + 4, out);
+  }
+  return { image, width, height };
+}
+
+// Reads a blob written by organize, choosing the decoder from its signature so
+// that PNG and QOI blobs can be mixed in one archive.
+image_type read_blob_from_file(const char* filename) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    return { std::vector<sample_type>(), 0, 0 };
+  }
+  char magic[4] = {};
+  file.read(magic, 4);
+  if (!file || memcmp(magic, "qoif", 4) != 0) {
+    file.close();
+    return read_png_from_file(filename);
+  }
+  file.seekg(0, std::ios::end);
+  std::vector<sample_type> blob(static_cast<size_t>(file.tellg()));
+  file.seekg(0);
+  file.read(reinterpret_cast<char*>(blob.data()), static_cast<std::streamsize>(blob.size()));
+  if (!file) {
+    return { std::vector<sample_type>(), 0, 0 };
+  }
+  return qoi_decode(blob);
+}
+
+// Moves the image by (shift_x, shift_y). Pixels that the shifted image does
+// not cover become transparent.
+std::vector<sample_type> shift_image(const std::vector<sample_type>& image, width_type width, height_type height, ptrdiff_t shift_x, ptrdiff_t shift_y) {
+  std::vector<sample_type> shifted(image.size());
+  const ptrdiff_t w = static_cast<ptrdiff_t>(width);
+  const ptrdiff_t h = static_cast<ptrdiff_t>(height);
+  const ptrdiff_t x0 = std::max<ptrdiff_t>(0, shift_x);
+  const ptrdiff_t x1 = std::min<ptrdiff_t>(w, w + shift_x);
+  if (x0 >= x1) {
+    return shifted;
+  }
+  for (ptrdiff_t y = std::max<ptrdiff_t>(0, shift_y); y < std::min<ptrdiff_t>(h, h + shift_y); ++y) {
+    memcpy_s(&shifted[(y * w + x0) * 4], (x1 - x0) * 4, &image[((y - shift_y) * w + x0 - shift_x) * 4], (x1 - x0) * 4);
+  }
+  return shifted;
+}
+
 image_type reconstruct(const std::string& prefix, const char* filename) {
   std::ifstream input(filename);
   if (!input) {
     return { std::vector<sample_type>(), 0, 0 };
   }
-  std::string png_filename;
+  std::string blob_filename;
   std::string origin_filename;
-  std::getline(input, png_filename);
+  std::getline(input, blob_filename);
   std::getline(input, origin_filename);
-  const auto png_path = prefix + png_filename;
-  if (input) {
+  const auto blob_path = prefix + blob_filename;
+  if (input && blob_filename.empty()) {
+    // An image identical to the referenced one has no blob of its own.
+    const auto origin_path = prefix + origin_filename;
+    return reconstruct(prefix, origin_path.c_str());
+  } else if (input) {
     size_t left, top;
     input >> left;
     input >> top;
+    ptrdiff_t shift_x = 0;
+    ptrdiff_t shift_y = 0;
+    if (!(input >> shift_x >> shift_y)) {
+      shift_x = 0;
+      shift_y = 0;
+    }
     const auto origin_path = prefix + origin_filename;
     auto [ base_image, base_width, base_height ] = reconstruct(prefix, origin_path.c_str());
     if (base_image.empty()) {
       return { std::vector<sample_type>(), 0, 0 };
     }
-    const auto [ over_image, over_width, over_height ] = read_png_from_file(png_path.c_str());
+    if (shift_x != 0 || shift_y != 0) {
+      base_image = shift_image(base_image, base_width, base_height, shift_x, shift_y);
+    }
+    const auto [ over_image, over_width, over_height ] = read_blob_from_file(blob_path.c_str());
     if (over_image.empty()) {
       return { std::vector<sample_type>(), 0, 0 };
     }
@@ -115,7 +223,7 @@ image_type reconstruct(const std::string& prefix, const char* filename) {
     }
     return { base_image, base_width, base_height };
   } else {
-    return read_png_from_file(png_path.c_str());
+    return read_blob_from_file(blob_path.c_str());
   }
 }
 
@@ -7,15 +7,87 @@
 #include <fstream>
 #include <cstring>
 #include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+#include <filesystem>
+#include <utility>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <random>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using sample_type = unsigned char;
 using width_type = size_t;
 using height_type = size_t;
 using image_type = std::tuple<std::vector<sample_type>, width_type, height_type>;
 
+// Per-thread state reused by calc_blob_size and the diff functions.
+// libpng cannot restart a write struct once an image has been written, so the
+// struct is still created per image, but every block it allocates (including
+// the zlib deflate state) is taken from and returned to free_blocks instead of
+// going through the heap, which avoids allocator contention between threads.
+struct encoder_context {
+  std::vector<png_bytep> rows;
+  std::vector<sample_type> cropped;
+  std::vector<uint32_t> parent_row;
+  std::vector<sample_type> blob;
+  std::vector<size_t*> free_blocks;  // each block starts with its capacity
+  ~encoder_context() {
+    for (auto block : free_blocks) {
+      free(block);
+    }
+  }
+};
+
+thread_local encoder_context encoder;
+
+constexpr size_t block_header_size = sizeof(std::max_align_t);
+constexpr size_t max_free_blocks = 64;
+
+png_voidp encoder_malloc(png_structp png, png_alloc_size_t size) {
+  auto& blocks = static_cast<encoder_context*>(png_get_mem_ptr(png))->free_blocks;
+  auto best = blocks.end();
+  for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+    if (**it >= size && (best == blocks.end() || **it < **best)) {
+      best = it;
+    }
+  }
+  size_t* block;
+  if (best != blocks.end()) {
+    block = *best;
+    *best = blocks.back();
+    blocks.pop_back();
+  } else {
+    block = static_cast<size_t*>(malloc(block_header_size + size));
+    if (!block) {
+      return nullptr;
+    }
+    *block = size;
+  }
+  return reinterpret_cast<char*>(block) + block_header_size;
+}
+
+void encoder_free(png_structp png, png_voidp ptr) {
+  if (!ptr) {
+    return;
+  }
+  auto& blocks = static_cast<encoder_context*>(png_get_mem_ptr(png))->free_blocks;
+  auto block = reinterpret_cast<size_t*>(static_cast<char*>(ptr) - block_header_size);
+  if (blocks.size() < max_free_blocks) {
+    blocks.push_back(block);
+  } else {
+    free(block);
+  }
+}
+
 size_t calc_png_size(sample_type* image, width_type width, height_type height) {
   size_t size = 0;
-  std::vector<png_bytep> rows(height);
+  auto& rows = encoder.rows;
+  rows.resize(height);
   for (size_t y = 0; y < height; y++) {
     rows[y] = image + 4 * static_cast<size_t>(width) * y;
   }
@@ -23,7 +95,7 @@ size_t calc_png_size(sample_type* image, width_type width, height_type height) {
     *static_cast<size_t*>(png_get_io_ptr(png)) += size;
   };
   const auto png_flush = [](png_structp png_ptr) {};
-  auto png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  auto png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr, &encoder, encoder_malloc, encoder_free);
   auto info = png_create_info_struct(png);
   if (!setjmp(png_jmpbuf(png))) {
     png_set_write_fn(png, &size, png_rw, png_flush);
@@ -35,39 +107,320 @@ size_t calc_png_size(sample_type* image, width_type width, height_type height) {
   return size;
 }
 
-size_t calc_diff_size(sample_type* from, sample_type* to, width_type width, height_type height) {
-  std::vector<sample_type> diff(width * height * 4);
-  size_t left = std::numeric_limits<size_t>::max();
-  size_t top = std::numeric_limits<size_t>::max();
-  size_t right = std::numeric_limits<size_t>::max();
-  size_t bottom = std::numeric_limits<size_t>::max();
-  uint32_t* f = reinterpret_cast<uint32_t*>(from);
-  uint32_t* t = reinterpret_cast<uint32_t*>(to);
-  uint32_t* d = reinterpret_cast<uint32_t*>(diff.data());
+// Returns row y of "image" shifted by (shift_x, shift_y). Pixels that the
+// shifted image does not cover are transparent.
+const uint32_t* shifted_row(const sample_type* image, width_type width, height_type height, size_t y, ptrdiff_t shift_x, ptrdiff_t shift_y, std::vector<uint32_t>& buffer) {
+  const uint32_t* source = reinterpret_cast<const uint32_t*>(image);
+  if (shift_x == 0 && shift_y == 0) {
+    return source + y * width;
+  }
+  buffer.assign(width, 0);
+  const ptrdiff_t sy = static_cast<ptrdiff_t>(y) - shift_y;
+  if (sy < 0 || sy >= static_cast<ptrdiff_t>(height)) {
+    return buffer.data();
+  }
+  const ptrdiff_t x0 = std::max<ptrdiff_t>(0, shift_x);
+  const ptrdiff_t x1 = std::min<ptrdiff_t>(width, width + shift_x);
+  if (x0 < x1) {
+    memcpy_s(buffer.data() + x0, (width - x0) * 4, source + sy * width + x0 - shift_x, (x1 - x0) * 4);
+  }
+  return buffer.data();
+}
+
+// Encodes an RGBA image in the QOI format (https://qoiformat.org/). It is
+// larger than PNG but decodes several times faster, so it suits archives that
+// are loaded at runtime.
+void qoi_encode(const sample_type* image, width_type width, height_type height, std::vector<sample_type>& out) {
+  const auto put32 = [&out](uint32_t v) {
+    out.push_back(static_cast<sample_type>(v >> 24));
+    out.push_back(static_cast<sample_type>(v >> 16));
+    out.push_back(static_cast<sample_type>(v >> 8));
+    out.push_back(static_cast<sample_type>(v));
+  };
+  out.clear();
+  out.reserve(14 + width * height + 8);
+  out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+  put32(static_cast<uint32_t>(width));
+  put32(static_cast<uint32_t>(height));
+  out.push_back(4);  // channels
+  out.push_back(0);  // sRGB with linear alpha
+  sample_type index[64][4] = {};
+  sample_type prev[4] = { 0, 0, 0, 0xff };
+  size_t run = 0;
+  const size_t num_pixels = width * height;
+  for (size_t i = 0; i < num_pixels; i++) {
+    const sample_type* px = image + i * 4;
+    if (memcmp(px, prev, 4) == 0) {
+      ++run;
+      if (run == 62 || i == num_pixels - 1) {
+        out.push_back(static_cast<sample_type>(0xc0 | (run - 1)));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      out.push_back(static_cast<sample_type>(0xc0 | (run - 1)));
+      run = 0;
+    }
+    const size_t hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+    if (memcmp(index[hash], px, 4) == 0) {
+      out.push_back(static_cast<sample_type>(hash));
+    } else {
+      memcpy_s(index[hash], 4, px, 4);
+      if (px[3] == prev[3]) {
+        const int vr = static_cast<signed char>(px[0] - prev[0]);
+        const int vg = static_cast<signed char>(px[1] - prev[1]);
+        const int vb = static_cast<signed char>(px[2] - prev[2]);
+        const int vg_r = vr - vg;
+        const int vg_b = vb - vg;
+        if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+          out.push_back(static_cast<sample_type>(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2)));
+        } else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 && vg_b >= -8 && vg_b <= 7) {
+          out.push_back(static_cast<sample_type>(0x80 | (vg + 32)));
+          out.push_back(static_cast<sample_type>((vg_r + 8) << 4 | (vg_b + 8)));
+        } else {
+          out.insert(out.end(), { 0xfe, px[0], px[1], px[2] });
+        }
+      } else {
+        out.insert(out.end(), { 0xff, px[0], px[1], px[2], px[3] });
+      }
+    }
+    memcpy_s(prev, 4, px, 4);
+  }
+  out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+}
+
+enum class codec_type { png, qoi };
+
+size_t calc_blob_size(codec_type codec, sample_type* image, width_type width, height_type height) {
+  if (codec == codec_type::qoi) {
+    qoi_encode(image, width, height, encoder.blob);
+    return encoder.blob.size();
+  }
+  return calc_png_size(image, width, height);
+}
+
+// Bounding box of the pixels that differ between "to" and "from" shifted by
+// (shift_x, shift_y), and the number of those pixels.
+struct diff_region {
+  size_t left;
+  size_t top;
+  size_t right;
+  size_t bottom;
+  size_t mismatches;
+};
+
+diff_region find_diff_region(const sample_type* from, const sample_type* to, width_type width, height_type height, ptrdiff_t shift_x, ptrdiff_t shift_y) {
+  diff_region region;
+  region.left = std::numeric_limits<size_t>::max();
+  region.top = std::numeric_limits<size_t>::max();
+  region.right = std::numeric_limits<size_t>::max();
+  region.bottom = std::numeric_limits<size_t>::max();
+  region.mismatches = 0;
+  const uint32_t* t = reinterpret_cast<const uint32_t*>(to);
   for (size_t y = 0; y < height; y++) {
+    const uint32_t* f = shifted_row(from, width, height, y, shift_x, shift_y, encoder.parent_row);
     for (size_t x = 0; x < width; x++) {
       if (*f != *t) {
-        *d = *t;
-        left = std::min(left, x);
-        top = std::min(top, y);
-        right = std::min(right, width - x - 1);
-        bottom = std::min(bottom, height - y - 1);
+        region.left = std::min(region.left, x);
+        region.top = std::min(region.top, y);
+        region.right = std::min(region.right, width - x - 1);
+        region.bottom = std::min(region.bottom, height - y - 1);
+        ++region.mismatches;
       }
       ++f;
       ++t;
-      ++d;
     }
   }
-  if (left == std::numeric_limits<size_t>::max()) {
+  return region;
+}
+
+size_t calc_diff_size(codec_type codec, const sample_type* from, const sample_type* to, width_type width, height_type height, ptrdiff_t shift_x, ptrdiff_t shift_y, const diff_region& region) {
+  if (region.mismatches == 0) {
     return 0;
   }
-  const size_t cw = width - left - right;
-  const size_t ch = height - top - bottom;
-  std::vector<sample_type> cropped(cw * ch * 4);
+  const size_t cw = width - region.left - region.right;
+  const size_t ch = height - region.top - region.bottom;
+  auto& cropped = encoder.cropped;
+  cropped.resize(cw * ch * 4);
+  uint32_t* c = reinterpret_cast<uint32_t*>(cropped.data());
   for (size_t y = 0; y < ch; y++) {
-    memcpy_s(cropped.data() + y * cw * 4, cw * 4, diff.data() + (top + y) * width * 4 + left * 4, cw * 4);
+    const uint32_t* f = shifted_row(from, width, height, region.top + y, shift_x, shift_y, encoder.parent_row) + region.left;
+    const uint32_t* t = reinterpret_cast<const uint32_t*>(to) + (region.top + y) * width + region.left;
+    for (size_t x = 0; x < cw; x++) {
+      *(c++) = (*f != *t) ? *t : 0;
+      ++f;
+      ++t;
+    }
   }
-  return calc_png_size(cropped.data(), cw, ch);
+  return calc_blob_size(codec, cropped.data(), cw, ch);
+}
+
+// Number of pixels that differ between "to" and "from" shifted by
+// (shift_x, shift_y), i.e. the number of opaque pixels in their diff.
+size_t calc_shifted_mismatches(const sample_type* from, const sample_type* to, width_type width, height_type height, ptrdiff_t shift_x, ptrdiff_t shift_y) {
+  size_t count = 0;
+  for (size_t y = 0; y < height; y++) {
+    const uint32_t* f = shifted_row(from, width, height, y, shift_x, shift_y, encoder.parent_row);
+    const uint32_t* t = reinterpret_cast<const uint32_t*>(to) + y * width;
+    size_t row_count = 0;
+    for (size_t x = 0; x < width; x++) {
+      row_count += (f[x] != t[x]) ? 1 : 0;
+    }
+    count += row_count;
+  }
+  return count;
+}
+
+// Mean absolute difference per overlapping pixel between "to" and "from"
+// shifted by (shift_x, shift_y). The inner loop is kept as a plain byte loop
+// so that the compiler vectorizes it.
+double calc_shifted_sad(const image_type& from, const image_type& to, ptrdiff_t shift_x, ptrdiff_t shift_y) {
+  const auto& [f, width, height] = from;
+  const auto& t = std::get<0>(to);
+  const ptrdiff_t w = static_cast<ptrdiff_t>(width);
+  const ptrdiff_t h = static_cast<ptrdiff_t>(height);
+  const ptrdiff_t x0 = std::max<ptrdiff_t>(0, shift_x);
+  const ptrdiff_t x1 = std::min<ptrdiff_t>(w, w + shift_x);
+  const ptrdiff_t y0 = std::max<ptrdiff_t>(0, shift_y);
+  const ptrdiff_t y1 = std::min<ptrdiff_t>(h, h + shift_y);
+  if (x0 >= x1 || y0 >= y1) {
+    return std::numeric_limits<double>::max();
+  }
+  const size_t row_bytes = static_cast<size_t>(x1 - x0) * 4;
+  uint64_t sum = 0;
+  for (ptrdiff_t y = y0; y < y1; y++) {
+    const sample_type* a = t.data() + (y * w + x0) * 4;
+    const sample_type* b = f.data() + ((y - shift_y) * w + x0 - shift_x) * 4;
+    uint32_t row_sum = 0;
+    for (size_t i = 0; i < row_bytes; i++) {
+      row_sum += static_cast<uint32_t>(std::abs(static_cast<int>(a[i]) - static_cast<int>(b[i])));
+    }
+    sum += row_sum;
+  }
+  return static_cast<double>(sum) / static_cast<double>((x1 - x0) * (y1 - y0));
+}
+
+image_type downsample(const sample_type* image, width_type width, height_type height) {
+  const width_type half_width = width / 2;
+  const height_type half_height = height / 2;
+  std::vector<sample_type> half(half_width * half_height * 4);
+  auto p = half.begin();
+  for (height_type y = 0; y < half_height; y++) {
+    const sample_type* upper = image + 2 * y * width * 4;
+    const sample_type* lower = upper + width * 4;
+    for (width_type x = 0; x < half_width; x++) {
+      for (size_t c = 0; c < 4; c++) {
+        *(p++) = static_cast<sample_type>((upper[c] + upper[c + 4] + lower[c] + lower[c + 4] + 2) / 4);
+      }
+      upper += 8;
+      lower += 8;
+    }
+  }
+  return { half, half_width, half_height };
+}
+
+// pyramid[k] is the image downsampled by 2^(k + 1).
+using pyramid_type = std::vector<image_type>;
+
+size_t calc_pyramid_levels(width_type width, height_type height, size_t shift_radius) {
+  size_t levels = 0;
+  while ((shift_radius >> levels) > 2 && (std::min(width, height) >> (levels + 1)) >= 16) {
+    levels++;
+  }
+  return levels;
+}
+
+pyramid_type build_pyramid(const sample_type* image, width_type width, height_type height, size_t levels) {
+  pyramid_type pyramid;
+  for (size_t level = 0; level < levels; level++) {
+    auto half = (level == 0) ? downsample(image, width, height)
+                             : downsample(std::get<0>(pyramid.back()).data(), std::get<1>(pyramid.back()), std::get<2>(pyramid.back()));
+    pyramid.push_back(std::move(half));
+  }
+  return pyramid;
+}
+
+using shift_type = std::pair<ptrdiff_t, ptrdiff_t>;
+
+// A shift found by find_shift and the number of pixels that differ with it.
+struct shift_candidate {
+  shift_type shift;
+  size_t mismatches;
+};
+
+// Coarse-to-fine search for the shift of "from" within shift_radius that
+// leaves the fewest differing pixels. The coarsest pyramid level is searched
+// exhaustively by SAD, each finer level refines the estimate by one pixel, and
+// the full-resolution candidates are compared by their exact number of
+// differing pixels. Only non-zero shifts are returned; whether the shift beats
+// the unshifted diff is decided by calc_pair_size.
+shift_candidate find_shift(const sample_type* from, const pyramid_type& from_pyramid, const sample_type* to, const pyramid_type& to_pyramid, width_type width, height_type height, size_t shift_radius) {
+  const ptrdiff_t radius = static_cast<ptrdiff_t>(shift_radius);
+  const size_t levels = from_pyramid.size();
+  ptrdiff_t center_x = 0;
+  ptrdiff_t center_y = 0;
+  ptrdiff_t window = radius >> levels;
+  for (size_t level = levels; level > 0; level--) {
+    const ptrdiff_t limit = radius >> level;
+    double best_sad = std::numeric_limits<double>::max();
+    ptrdiff_t best_x = center_x;
+    ptrdiff_t best_y = center_y;
+    for (ptrdiff_t y = center_y - window; y <= center_y + window; y++) {
+      for (ptrdiff_t x = center_x - window; x <= center_x + window; x++) {
+        if (std::abs(x) > limit || std::abs(y) > limit) {
+          continue;
+        }
+        const double sad = calc_shifted_sad(from_pyramid[level - 1], to_pyramid[level - 1], x, y);
+        if (sad < best_sad) {
+          best_sad = sad;
+          best_x = x;
+          best_y = y;
+        }
+      }
+    }
+    center_x = best_x * 2;
+    center_y = best_y * 2;
+    window = 1;
+  }
+  shift_candidate best = { shift_type(0, 0), std::numeric_limits<size_t>::max() };
+  for (ptrdiff_t y = center_y - window; y <= center_y + window; y++) {
+    for (ptrdiff_t x = center_x - window; x <= center_x + window; x++) {
+      if (std::abs(x) > radius || std::abs(y) > radius || (x == 0 && y == 0)) {
+        continue;
+      }
+      const size_t count = calc_shifted_mismatches(from, to, width, height, x, y);
+      if (count < best.mismatches) {
+        best = { shift_type(x, y), count };
+      }
+    }
+  }
+  return best;
+}
+
+// find_shift is only run for pairs with from < to. Swapping the images and
+// negating the shift compares the same pixels, so the reverse pair reuses it.
+shift_candidate get_shift_candidate(const std::vector<std::vector<shift_candidate> >& candidates, int from, int to) {
+  if (candidates.empty()) {
+    return { shift_type(0, 0), std::numeric_limits<size_t>::max() };
+  }
+  if (from < to) {
+    return candidates[from][to];
+  }
+  const auto& candidate = candidates[to][from];
+  return { shift_type(-candidate.shift.first, -candidate.shift.second), candidate.mismatches };
+}
+
+size_t calc_pair_size(codec_type codec, const sample_type* from, const sample_type* to, width_type width, height_type height, const shift_candidate& candidate, shift_type& shift) {
+  // The unshifted mismatches come out of the bounding-box pass, so the shift
+  // costs a second pass only when it wins.
+  shift = shift_type(0, 0);
+  auto region = find_diff_region(from, to, width, height, 0, 0);
+  if (candidate.mismatches < region.mismatches) {
+    shift = candidate.shift;
+    region = find_diff_region(from, to, width, height, shift.first, shift.second);
+  }
+  return calc_diff_size(codec, from, to, width, height, shift.first, shift.second, region);
 }
 
 image_type read_png_from_file(const char* filename) {
@@ -105,49 +458,472 @@ image_type read_png_from_file(const char* filename) {
   return { image, width, height };
 }
 
-int main(int argc, char** argv) {
-  if (argc < 3) {
-    std::cout << "usage: scan input1.png input2.png ... [> matrix.txt]" << std::endl;
-    return 0;
+// 64-bit hash of the decoded pixels, used to find identical images before the
+// cost matrix is computed.
+uint64_t hash_image(const sample_type* image, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ull ^ size;
+  const size_t num_words = size / 8;
+  for (size_t i = 0; i < num_words; i++) {
+    uint64_t word;
+    memcpy(&word, image + i * 8, 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+  }
+  for (size_t i = num_words * 8; i < size; i++) {
+    hash = (hash ^ image[i]) * 0x9e3779b97f4a7c15ull;
   }
-  char** input_files = argv + 1;
-  int num_input_files = argc - 1;
-  std::cout << num_input_files << std::endl;
+  return hash;
+}
+
+constexpr size_t tile_cache_bytes = 8 * 1024 * 1024;
+constexpr size_t max_tile_size = 16;
+
+// Only one image of each group of identical images enters the matrix.
+// group[i] is the row of the matrix that input image i maps to.
+bool scan_in_memory(char** input_files, int num_input_files, codec_type codec, size_t shift_radius, std::vector<int>& group, std::vector<std::vector<size_t> >& result_matrix, std::vector<std::vector<shift_type> >& shift_matrix) {
   std::vector<image_type> images(num_input_files);
+  // Images are independent, so they are decoded in parallel. The buffers are
+  // not placed with regard to NUMA nodes.
+#pragma omp parallel for schedule(dynamic, 1)
   for (int i = 0; i < num_input_files; i++) {
-    std::cout << input_files[i] << std::endl;
     images[i] = read_png_from_file(input_files[i]);
+  }
+  for (int i = 0; i < num_input_files; i++) {
     if (std::get<0>(images[i]).empty()) {
       std::cerr << "failed to read \"" << input_files[i] << "\"" << std::endl;
-      return -1;
+      return false;
     }
     if (std::get<1>(images[i]) != std::get<1>(images[0]) || std::get<2>(images[i]) != std::get<2>(images[0])) {
       std::cerr << "unmatched image size in \"" << input_files[i] << "\"" << std::endl;
-      return -1;
+      return false;
     }
   }
-  std::vector<std::vector<size_t> > result_matrix(num_input_files);
+  std::vector<uint64_t> hashes(num_input_files);
+#pragma omp parallel for schedule(dynamic, 1)
   for (int i = 0; i < num_input_files; i++) {
-    result_matrix[i].resize(num_input_files);
+    hashes[i] = hash_image(std::get<0>(images[i]).data(), std::get<0>(images[i]).size());
+  }
+  // Representatives are moved to the front of images as they are found.
+  std::unordered_multimap<uint64_t, int> representatives;
+  int num_images = 0;
+  group.assign(num_input_files, -1);
+  for (int i = 0; i < num_input_files; i++) {
+    const auto range = representatives.equal_range(hashes[i]);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (std::get<0>(images[it->second]) == std::get<0>(images[i])) {
+        group[i] = it->second;
+        break;
+      }
+    }
+    if (group[i] < 0) {
+      group[i] = num_images;
+      representatives.emplace(hashes[i], num_images);
+      if (num_images != i) {
+        images[num_images] = std::move(images[i]);
+      }
+      num_images++;
+    }
+  }
+  images.resize(num_images);
+  result_matrix.assign(num_images, std::vector<size_t>(num_images));
+  shift_matrix.assign(num_images, std::vector<shift_type>(num_images));
+  const width_type width = std::get<1>(images[0]);
+  const height_type height = std::get<2>(images[0]);
+  const size_t levels = calc_pyramid_levels(width, height, shift_radius);
+  std::vector<pyramid_type> pyramids(num_images);
+  if (shift_radius > 0) {
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < num_images; i++) {
+      pyramids[i] = build_pyramid(std::get<0>(images[i]).data(), width, height, levels);
+    }
+  }
+  // The matrix is split into tiles of tile_size x tile_size pairs so that the
+  // images of a tile stay in cache while its pairs are processed. Pair costs
+  // vary a lot (identical pairs return at once), so tiles are handed out
+  // dynamically.
+  const size_t image_bytes = std::get<0>(images[0]).size();
+  const int tile_size = static_cast<int>(std::clamp<size_t>(tile_cache_bytes / (2 * image_bytes), 1, max_tile_size));
+  const int num_tiles = (num_images + tile_size - 1) / tile_size;
+  std::vector<std::vector<shift_candidate> > candidates;
+  if (shift_radius > 0) {
+    candidates.assign(num_images, std::vector<shift_candidate>(num_images));
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int tile = 0; tile < num_tiles * num_tiles; tile++) {
+      const int from_begin = tile / num_tiles * tile_size;
+      const int from_end = std::min(from_begin + tile_size, num_images);
+      const int to_begin = tile % num_tiles * tile_size;
+      const int to_end = std::min(to_begin + tile_size, num_images);
+      for (int from = from_begin; from < from_end; from++) {
+        for (int to = std::max(to_begin, from + 1); to < to_end; to++) {
+          candidates[from][to] = find_shift(std::get<0>(images[from]).data(), pyramids[from], std::get<0>(images[to]).data(), pyramids[to], width, height, shift_radius);
+        }
+      }
+    }
+  }
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int tile = 0; tile < num_tiles * num_tiles; tile++) {
+    const int from_begin = tile / num_tiles * tile_size;
+    const int from_end = std::min(from_begin + tile_size, num_images);
+    const int to_begin = tile % num_tiles * tile_size;
+    const int to_end = std::min(to_begin + tile_size, num_images);
+    for (int from = from_begin; from < from_end; from++) {
+      for (int to = to_begin; to < to_end; to++) {
+        if (from == to) {
+          result_matrix[from][from] = calc_blob_size(codec, std::get<0>(images[from]).data(), std::get<1>(images[from]), std::get<2>(images[from]));
+        } else {
+          result_matrix[from][to] = calc_pair_size(codec, std::get<0>(images[from]).data(), std::get<0>(images[to]).data(), width, height, get_shift_candidate(candidates, from, to), shift_matrix[from][to]);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool load_block(std::fstream& cache, int begin, int end, size_t image_bytes, std::vector<sample_type>& block) {
+  cache.seekg(static_cast<std::streamoff>(begin) * static_cast<std::streamoff>(image_bytes));
+  cache.read(reinterpret_cast<char*>(block.data()), static_cast<std::streamsize>((end - begin) * image_bytes));
+  return static_cast<bool>(cache);
+}
+
+int get_max_threads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+// Creates an empty cache file with a random name in the temporary directory.
+// The file is created exclusively, so concurrent scans never share a cache.
+bool create_cache_file(std::string& cache_filename) {
+  std::error_code ec;
+  const auto directory = std::filesystem::temp_directory_path(ec);
+  if (ec) {
+    std::cerr << "failed to find the temporary directory: " << ec.message() << std::endl;
+    return false;
+  }
+  std::random_device device;
+  std::mt19937_64 engine((static_cast<uint64_t>(device()) << 32) ^ device());
+  for (int attempt = 0; attempt < 16; attempt++) {
+    char suffix[17];
+    snprintf(suffix, sizeof(suffix), "%016llx", static_cast<unsigned long long>(engine()));
+    const auto filename = (directory / (std::string("stia_scan_") + suffix + ".raw")).string();
+    FILE* fp;
+    if (!fopen_s(&fp, filename.c_str(), "wbx") && fp) {
+      fclose(fp);
+      cache_filename = filename;
+      return true;
+    }
+  }
+  std::cerr << "failed to create a cache file in \"" << directory.string() << "\"" << std::endl;
+  return false;
+}
+
+// Memory each worker thread may hold besides the image blocks: the cropped
+// diff, the encoded blob (QOI may exceed the frame size) or libpng's row copies
+// while decoding, plus the pooled libpng/zlib state.
+size_t calc_thread_scratch_bytes(size_t image_bytes) {
+  return 2 * image_bytes + image_bytes / 4 + 1024 * 1024;
+}
+
+// Memory taken by the executable, the runtime libraries and the stream buffers
+// regardless of the images.
+constexpr size_t process_overhead_bytes = 8 * 1024 * 1024;
+
+// Computes the matrix while keeping at most two blocks of decoded images in
+// memory. The images are decoded once into a raw cache file, then for each
+// block of "from" images every block of "to" images is paged in, so each block
+// is read from the cache once per pass over the matrix. Identical images are
+// grouped as in scan_in_memory, and only representatives are written to the
+// cache.
+bool scan_out_of_core(char** input_files, int num_input_files, size_t memory_limit, const std::string& cache_filename, codec_type codec, size_t shift_radius, std::vector<int>& group, std::vector<std::vector<size_t> >& result_matrix, std::vector<std::vector<shift_type> >& shift_matrix) {
+  auto first = read_png_from_file(input_files[0]);
+  if (std::get<0>(first).empty()) {
+    std::cerr << "failed to read \"" << input_files[0] << "\"" << std::endl;
+    return false;
+  }
+  const width_type width = std::get<1>(first);
+  const height_type height = std::get<2>(first);
+  const size_t image_bytes = std::get<0>(first).size();
+  const size_t levels = calc_pyramid_levels(width, height, shift_radius);
+  // The pyramid of an image takes up to a third of the image itself.
+  const size_t resident_bytes = image_bytes + ((levels > 0) ? image_bytes / 3 : 0);
+  // Besides the two blocks, the budget has to hold the process itself, the
+  // per-thread scratch, the matrices and the buffer used to compare duplicates.
+  const size_t matrix_bytes = static_cast<size_t>(num_input_files) * num_input_files * (sizeof(size_t) + sizeof(shift_type) + ((shift_radius > 0) ? sizeof(shift_candidate) : 0));
+  const size_t fixed_bytes = process_overhead_bytes + get_max_threads() * calc_thread_scratch_bytes(image_bytes) + matrix_bytes + image_bytes;
+  if (memory_limit < fixed_bytes + 2 * resident_bytes) {
+    const size_t megabytes = (fixed_bytes + 2 * resident_bytes + 1024 * 1024 - 1) / (1024 * 1024);
+    std::cerr << "memory limit is too small, at least " << megabytes << " MB is needed for these images" << std::endl;
+    return false;
+  }
+  const int block_size = static_cast<int>(std::min<size_t>((memory_limit - fixed_bytes) / (2 * resident_bytes), num_input_files));
+  std::fstream cache(cache_filename, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!cache) {
+    std::cerr << "failed to write \"" << cache_filename << "\"" << std::endl;
+    return false;
+  }
+  // The block buffers are allocated before anything else so that the decode
+  // phase, which stages images in to_block, does not fragment the heap.
+  std::vector<sample_type> from_block(block_size * image_bytes);
+  std::vector<sample_type> to_block(block_size * image_bytes);
+  std::unordered_multimap<uint64_t, int> representatives;
+  int num_images = 0;
+  group.assign(num_input_files, -1);
+  {
+    enum { decoded, read_failed, size_unmatched };
+    std::vector<int> status(block_size);
+    std::vector<uint64_t> hashes(block_size);
+    std::vector<sample_type> candidate(image_bytes);
+    memcpy_s(to_block.data(), image_bytes, std::get<0>(first).data(), image_bytes);
+    first = image_type();
+    for (int begin = 0; begin < num_input_files; begin += block_size) {
+      const int end = std::min(begin + block_size, num_input_files);
+#pragma omp parallel for schedule(dynamic, 1)
+      for (int i = begin; i < end; i++) {
+        sample_type* const slot = to_block.data() + (i - begin) * image_bytes;
+        status[i - begin] = decoded;
+        if (i > 0) {
+          const auto image = read_png_from_file(input_files[i]);
+          if (std::get<0>(image).empty()) {
+            status[i - begin] = read_failed;
+            continue;
+          }
+          if (std::get<1>(image) != width || std::get<2>(image) != height) {
+            status[i - begin] = size_unmatched;
+            continue;
+          }
+          memcpy_s(slot, image_bytes, std::get<0>(image).data(), image_bytes);
+        }
+        hashes[i - begin] = hash_image(slot, image_bytes);
+      }
+      for (int i = begin; i < end; i++) {
+        const sample_type* const slot = to_block.data() + (i - begin) * image_bytes;
+        if (status[i - begin] == read_failed) {
+          std::cerr << "failed to read \"" << input_files[i] << "\"" << std::endl;
+          return false;
+        }
+        if (status[i - begin] == size_unmatched) {
+          std::cerr << "unmatched image size in \"" << input_files[i] << "\"" << std::endl;
+          return false;
+        }
+        const auto range = representatives.equal_range(hashes[i - begin]);
+        for (auto it = range.first; it != range.second; ++it) {
+          if (!load_block(cache, it->second, it->second + 1, image_bytes, candidate)) {
+            std::cerr << "failed to read \"" << cache_filename << "\"" << std::endl;
+            return false;
+          }
+          if (memcmp(candidate.data(), slot, image_bytes) == 0) {
+            group[i] = it->second;
+            break;
+          }
+        }
+        if (group[i] < 0) {
+          group[i] = num_images;
+          representatives.emplace(hashes[i - begin], num_images);
+          cache.seekp(static_cast<std::streamoff>(num_images) * static_cast<std::streamoff>(image_bytes));
+          cache.write(reinterpret_cast<const char*>(slot), static_cast<std::streamsize>(image_bytes));
+          num_images++;
+        }
+      }
+    }
+    if (!cache.flush()) {
+      std::cerr << "failed to write \"" << cache_filename << "\"" << std::endl;
+      return false;
+    }
+  }
+  result_matrix.assign(num_images, std::vector<size_t>(num_images));
+  shift_matrix.assign(num_images, std::vector<shift_type>(num_images));
+  std::vector<std::vector<shift_candidate> > candidates;
+  if (shift_radius > 0) {
+    candidates.assign(num_images, std::vector<shift_candidate>(num_images));
+  }
+  std::vector<pyramid_type> from_pyramids(block_size);
+  std::vector<pyramid_type> to_pyramids(block_size);
+  const auto build_pyramids = [&](int begin, int end, const std::vector<sample_type>& block, std::vector<pyramid_type>& pyramids) {
+    if (shift_radius > 0) {
+#pragma omp parallel for schedule(dynamic, 1)
+      for (int i = begin; i < end; i++) {
+        pyramids[i - begin] = build_pyramid(block.data() + (i - begin) * image_bytes, width, height, levels);
+      }
+    }
+  };
+  for (int from_begin = 0; from_begin < num_images; from_begin += block_size) {
+    const int from_end = std::min(from_begin + block_size, num_images);
+    if (!load_block(cache, from_begin, from_end, image_bytes, from_block)) {
+      std::cerr << "failed to read \"" << cache_filename << "\"" << std::endl;
+      return false;
+    }
+    build_pyramids(from_begin, from_end, from_block, from_pyramids);
+    for (int to_begin = 0; to_begin < num_images; to_begin += block_size) {
+      const int to_end = std::min(to_begin + block_size, num_images);
+      if (to_begin != from_begin && !load_block(cache, to_begin, to_end, image_bytes, to_block)) {
+        std::cerr << "failed to read \"" << cache_filename << "\"" << std::endl;
+        return false;
+      }
+      if (to_begin != from_begin) {
+        build_pyramids(to_begin, to_end, to_block, to_pyramids);
+      }
+      sample_type* const from_images = from_block.data();
+      sample_type* const to_images = (to_begin == from_begin) ? from_block.data() : to_block.data();
+      const auto& to_block_pyramids = (to_begin == from_begin) ? from_pyramids : to_pyramids;
+      const int to_count = to_end - to_begin;
+      const int num_pairs = (from_end - from_begin) * to_count;
+      // Blocks are visited with from_begin ascending, so the candidates of the
+      // reverse pairs of a block below the diagonal were found earlier.
+      if (shift_radius > 0 && from_begin <= to_begin) {
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int pair = 0; pair < num_pairs; pair++) {
+          const int from = from_begin + pair / to_count;
+          const int to = to_begin + pair % to_count;
+          if (from < to) {
+            candidates[from][to] = find_shift(from_images + (from - from_begin) * image_bytes, from_pyramids[from - from_begin], to_images + (to - to_begin) * image_bytes, to_block_pyramids[to - to_begin], width, height, shift_radius);
+          }
+        }
+      }
+#pragma omp parallel for schedule(dynamic, 1)
+      for (int pair = 0; pair < num_pairs; pair++) {
+        const int from = from_begin + pair / to_count;
+        const int to = to_begin + pair % to_count;
+        sample_type* const f = from_images + (from - from_begin) * image_bytes;
+        sample_type* const t = to_images + (to - to_begin) * image_bytes;
+        if (from == to) {
+          result_matrix[from][from] = calc_blob_size(codec, f, width, height);
+        } else {
+          result_matrix[from][to] = calc_pair_size(codec, f, t, width, height, get_shift_candidate(candidates, from, to), shift_matrix[from][to]);
+        }
+      }
+    }
   }
-#pragma omp parallel for
-  for (int from = 0; from < num_input_files; from++) {
-    for (int to = 0; to < num_input_files; to++) {
-      if (from == to) {
-        result_matrix[from][from] = calc_png_size(std::get<0>(images[from]).data(), std::get<1>(images[from]), std::get<2>(images[from]));
+  return true;
+}
+
+void print_usage() {
+  std::cout << "usage: scan [--memory-limit MB [--cache cache.raw]] [--shift-radius R] [--codec png|qoi] input1.png input2.png ... [> matrix.txt]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  size_t memory_limit = 0;
+  size_t shift_radius = 0;
+  codec_type codec = codec_type::png;
+  std::string cache_filename;
+  std::vector<char*> input_files;
+  int i = 1;
+  while (i < argc) {
+    if (strcmp(argv[i], "--memory-limit") == 0) {
+      ++i;
+      char* end = nullptr;
+      const size_t megabytes = (i < argc) ? strtoull(argv[i], &end, 10) : 0;
+      if (megabytes == 0 || *end != '\0') {
+        print_usage();
+        return 0;
+      }
+      memory_limit = megabytes * 1024 * 1024;
+      ++i;
+    } else if (strcmp(argv[i], "--shift-radius") == 0) {
+      ++i;
+      char* end = nullptr;
+      shift_radius = (i < argc) ? strtoull(argv[i], &end, 10) : 0;
+      if (end == nullptr || end == argv[i] || *end != '\0') {
+        print_usage();
+        return 0;
+      }
+      ++i;
+    } else if (strcmp(argv[i], "--codec") == 0) {
+      ++i;
+      if (i < argc && strcmp(argv[i], "png") == 0) {
+        codec = codec_type::png;
+      } else if (i < argc && strcmp(argv[i], "qoi") == 0) {
+        codec = codec_type::qoi;
       } else {
-        result_matrix[from][to] = calc_diff_size(std::get<0>(images[from]).data(), std::get<0>(images[to]).data(), std::get<1>(images[from]), std::get<2>(images[from]));
+        print_usage();
+        return 0;
+      }
+      ++i;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      ++i;
+      if (i >= argc) {
+        print_usage();
+        return 0;
       }
+      cache_filename = argv[i];
+      ++i;
+    } else {
+      input_files.push_back(argv[i]);
+      ++i;
+    }
+  }
+  if (input_files.size() < 2) {
+    print_usage();
+    return 0;
+  }
+  int num_input_files = static_cast<int>(input_files.size());
+  std::vector<int> group;
+  std::vector<std::vector<size_t> > result_matrix;
+  std::vector<std::vector<shift_type> > shift_matrix;
+  if (memory_limit == 0) {
+    if (!scan_in_memory(input_files.data(), num_input_files, codec, shift_radius, group, result_matrix, shift_matrix)) {
+      return -1;
+    }
+  } else {
+    if (cache_filename.empty() && !create_cache_file(cache_filename)) {
+      return -1;
+    }
+    const bool succeeded = scan_out_of_core(input_files.data(), num_input_files, memory_limit, cache_filename, codec, shift_radius, group, result_matrix, shift_matrix);
+    std::error_code ec;
+    std::filesystem::remove(cache_filename, ec);
+    if (!succeeded) {
+      return -1;
+    }
+  }
+  const int num_images = static_cast<int>(result_matrix.size());
+  std::cout << num_images << std::endl;
+  // Representatives are numbered in input order, so an image is an alias
+  // exactly when its group was already taken by an earlier image.
+  std::vector<bool> is_alias(num_input_files);
+  int num_aliases = 0;
+  for (int i = 0; i < num_input_files; i++) {
+    is_alias[i] = (group[i] != i - num_aliases);
+    if (is_alias[i]) {
+      num_aliases++;
+    } else {
+      std::cout << input_files[i] << std::endl;
     }
   }
-  for (int from = 0; from < num_input_files; from++) {
-    for (int to = 0; to < num_input_files; to++) {
+  for (int from = 0; from < num_images; from++) {
+    for (int to = 0; to < num_images; to++) {
       std::cout << result_matrix[from][to];
-      if (to != num_input_files - 1) {
+      if (to != num_images - 1) {
         std::cout << "\t";
       } else {
         std::cout << std::endl;
       }
     }
   }
+  // The shifts follow the matrix so that formulate, which reads only the
+  // matrix, is unaffected. organize applies them when writing the diffs.
+  if (shift_radius > 0) {
+    std::cout << "shift" << std::endl;
+    for (int from = 0; from < num_images; from++) {
+      for (int to = 0; to < num_images; to++) {
+        std::cout << shift_matrix[from][to].first << "," << shift_matrix[from][to].second;
+        if (to != num_images - 1) {
+          std::cout << "\t";
+        } else {
+          std::cout << std::endl;
+        }
+      }
+    }
+  }
+  // Images identical to an earlier one are listed with the matrix row they
+  // map to, so that organize stores them as aliases.
+  if (num_aliases > 0) {
+    std::cout << "alias" << std::endl;
+    std::cout << num_aliases << std::endl;
+    for (int i = 0; i < num_input_files; i++) {
+      if (is_alias[i]) {
+        std::cout << group[i] << "\t" << input_files[i] << std::endl;
+      }
+    }
+  }
 }